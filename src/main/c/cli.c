@@ -1,10 +1,22 @@
+#include <getopt.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#include "csv.h"
 #include "mf_parser.h"
+#include "mf_stream.h"
 #include "signals.h"
+#ifdef CHEMIKAZE_WITH_SERVER
+#include <unistd.h>
+
+#include "server.h"
+#endif
+
+// A quoted field may contain line breaks, but a row this long most likely has a stray quote.
+#define MAX_ROW_LINES 100
 
 size_t getFileSize(FILE *f) {
 	fseek(f, 0, SEEK_END);
@@ -77,14 +89,295 @@ unsigned findMfBounds(char *buf, size_t size, MfBounds **mfBounds) {
 	return mfcount;
 }
 
-int main(int argc, [[maybe_unused]] char **argv) {
+double secondsBetween(const struct timespec *start, const struct timespec *end) {
+	return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+typedef struct { unsigned mfCnt; size_t hcount; } StreamedMfStats;
+
+void parseStreamedMf(const char *start, const char *end, void *ctx) {
+	if (start == end)
+		return;// empty lines, e.g. at the end of the file
+	StreamedMfStats *stats = ctx;
+	ChemikazeError *error = nullptr;
+	AtomCounts *counts = parseMfChunk(start, end, &error);
+	if (counts == nullptr) {
+		fprintf(stderr, "%s\n", error->msg);
+		exit(1);
+	}
+	stats->hcount += counts->counts[0];
+	stats->mfCnt++;
+	AtomCounts_free(counts);
+}
+
+/**
+ * Compressed files are parsed once while they are being decompressed, so unlike the in-memory benchmark this one
+ * includes the decompression. Wall time is measured since the decompression runs in a separate thread.
+ */
+int benchmarkStreamed(const char *filepath, MfFileFormat format) {
+	StreamedMfStats stats = {};
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ChemikazeError *error = readMfLines(filepath, format, parseStreamedMf, &stats);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (error) {
+		fprintf(stderr, "%s\n", error->msg);
+		ChemikazeError_free(error);
+		return 1;
+	}
+	double elapsed = secondsBetween(&start, &end);
+	printf("[C BENCHMARK] %u streamed MFs in %f sec (%d MF/s)\n", stats.mfCnt, elapsed, (int) (stats.mfCnt/elapsed));
+	return 0;
+}
+
+typedef struct {
+	char delimiter, quote;
+	unsigned column;   // 0-based
+	bool header;       // the 1st row contains column names, it's not parsed
+	bool append;       // print each row with 2 extra columns: the parsed atoms and the error
+	unsigned columnCnt;// in the 1st row, shorter rows are padded to it with --append
+	char *pending;     // a row with a quoted field that continues on the next line
+	size_t pendingLen, pendingCap;
+	unsigned pendingLineCnt;
+	bool quoteOpen;    // the last line ended inside a quoted field
+	unsigned rowCnt, errCnt;
+} TabularMfCtx;
+
+void writeField(const char *str, const TabularMfCtx *ctx) {
+	if (!ctx->quote || strpbrk(str, (char[]) {ctx->delimiter, ctx->quote, '\r', '\n', '\0'}) == nullptr) {
+		fputs(str, stdout);
+		return;
+	}
+	putchar(ctx->quote);
+	for (; *str; str++) {
+		if (*str == ctx->quote)
+			putchar(ctx->quote);
+		putchar(*str);
+	}
+	putchar(ctx->quote);
+}
+void writeRow(const char *row, const char *rowEnd, const char *atoms, const char *error, const TabularMfCtx *ctx) {
+	fwrite(row, 1, rowEnd - row, stdout);
+	// so that the appended columns are at the same position in all the rows
+	for (unsigned i = csv_countFields(row, rowEnd, ctx->delimiter, ctx->quote); i < ctx->columnCnt; i++)
+		putchar(ctx->delimiter);
+	putchar(ctx->delimiter);
+	writeField(atoms, ctx);
+	putchar(ctx->delimiter);
+	writeField(error, ctx);
+	putchar('\n');
+}
+
+void reportRowError(const char *row, const char *rowEnd, const char *error, TabularMfCtx *ctx) {
+	ctx->errCnt++;
+	if (ctx->append)
+		writeRow(row, rowEnd, "", error, ctx);
+	else
+		fprintf(stderr, "Row %u: %s\n", ctx->rowCnt, error);
+}
+
+/**
+ * @param quoteOpen the row ends inside a quoted field: either the file ended, or the row got longer than
+ *                  MAX_ROW_LINES - most likely because of a stray quote
+ */
+void parseTabularRow(const char *row, const char *rowEnd, bool quoteOpen, TabularMfCtx *ctx) {
+	if (row == rowEnd)
+		return;
+	if (ctx->rowCnt++ == 0 && ctx->append)
+		ctx->columnCnt = csv_countFields(row, rowEnd, ctx->delimiter, ctx->quote);
+	if (ctx->rowCnt == 1 && ctx->header) {
+		if (ctx->append)
+			writeRow(row, rowEnd, "atoms", "error", ctx);
+		return;
+	}
+	if (quoteOpen) {
+		reportRowError(row, rowEnd, "The row has a quote that isn't closed", ctx);
+		return;
+	}
+	const char *mf, *mfEnd;
+	if (!csv_findField(row, rowEnd, ctx->delimiter, ctx->quote, ctx->column, &mf, &mfEnd)) {
+		reportRowError(row, rowEnd, "The row doesn't have the MF column", ctx);
+		return;
+	}
+	while (mf < mfEnd && *mf == ' ')
+		mf++;// trim like parseMf() does
+	while (mf < mfEnd && mfEnd[-1] == ' ')
+		mfEnd--;
+
+	ChemikazeError *error = nullptr;
+	AtomCounts *counts = parseMfChunk(mf, mfEnd, &error);
+	if (error) {
+		reportRowError(row, rowEnd, error->msg, ctx);
+		ChemikazeError_free(error);
+		return;
+	}
+	if (ctx->append) {
+		char *atoms = AtomCounts_toString(counts);
+		writeRow(row, rowEnd, atoms, "", ctx);
+		free(atoms);
+	}
+	AtomCounts_free(counts);
+}
+
+void appendToPendingRow(TabularMfCtx *ctx, const char *start, const char *end) {
+	size_t len = end - start;
+	if (ctx->pendingLen + len > ctx->pendingCap) {
+		ctx->pendingCap = (ctx->pendingLen + len) * 2;
+		if ((ctx->pending = realloc(ctx->pending, ctx->pendingCap)) == nullptr) {
+			perror("Couldn't allocate memory for a multi-line row");
+			exit(1);
+		}
+	}
+	memcpy(ctx->pending + ctx->pendingLen, start, len);
+	ctx->pendingLen += len;
+}
+
+/**
+ * Usually a line is a whole row, and it's parsed in place. But a quoted field can contain line breaks, in such
+ * case the lines are joined in a separate buffer until the quote is closed. Only the new line is scanned for quotes,
+ * and a row can't be longer than MAX_ROW_LINES, so a stray quote doesn't turn the rest of the file into one row.
+ */
+void parseTabularLine(const char *line, const char *lineEnd, void *ctxPtr) {
+	TabularMfCtx *ctx = ctxPtr;
+	if (lineEnd > line && lineEnd[-1] == '\r')
+		lineEnd--;
+	bool continuesRow = ctx->pendingLineCnt > 0;
+	ctx->quoteOpen = csv_isQuoteOpenAtEnd(line, lineEnd, ctx->delimiter, ctx->quote, ctx->quoteOpen);
+	if (!continuesRow && !ctx->quoteOpen) {
+		parseTabularRow(line, lineEnd, false, ctx);
+		return;
+	}
+	if (continuesRow)
+		appendToPendingRow(ctx, "\n", "\n" + 1);
+	appendToPendingRow(ctx, line, lineEnd);
+	if (++ctx->pendingLineCnt < MAX_ROW_LINES && ctx->quoteOpen)
+		return;
+	parseTabularRow(ctx->pending, ctx->pending + ctx->pendingLen, ctx->quoteOpen, ctx);
+	ctx->pendingLen = ctx->pendingLineCnt = 0;
+	ctx->quoteOpen = false;
+}
+
+/**
+ * Parses MFs right from a column of CSV/TSV file, the file is streamed the same way as the compressed MF files.
+ */
+int parseTabular(const char *filepath, TabularMfCtx *ctx) {
+	if (ctx->append)
+		setvbuf(stdout, nullptr, _IOFBF, 1 << 20);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ChemikazeError *error = readMfLines(filepath, detectMfFileFormat(filepath), parseTabularLine, ctx);
+	if (ctx->pendingLineCnt) // the file ended before the quote was closed
+		parseTabularRow(ctx->pending, ctx->pending + ctx->pendingLen, true, ctx);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(ctx->pending);
+	if (error) {
+		fprintf(stderr, "%s\n", error->msg);
+		ChemikazeError_free(error);
+		return 1;
+	}
+	unsigned mfCnt = ctx->rowCnt - (ctx->header && ctx->rowCnt);
+	double elapsed = secondsBetween(&start, &end);
+	// with --append the stdout is occupied by the rows
+	fprintf(ctx->append ? stderr : stdout, "[C BENCHMARK] %u tabular MFs (%u errors) in %f sec (%d MF/s)\n",
+			mfCnt, ctx->errCnt, elapsed, (int) (mfCnt/elapsed));
+	return 0;
+}
+
+void printUsage() {
+	fprintf(stderr, "Usage: chemikaze [--csv | --tsv] [--column N] [--header] [--append] FILE\n"
+					"       chemikaze serve [--workers N] SOCKET\n"
+					"  FILE         Molecular Formulas, one per line, may be compressed (.gz, .zst)\n"
+					"  --csv, --tsv FILE is a table, and the MFs are in one of its columns\n"
+					"  --column N   1-based number of the MF column, 1 by default\n"
+					"  --header     the 1st row contains the column names\n"
+					"  --append     print the rows with the parsed atoms and the error appended\n"
+					"  SOCKET       Unix domain socket to accept the requests on, see protocol.h\n"
+					"  --workers N  threads that parse big batches of requests, CPU count - 1 by default\n");
+}
+
+int mainServe(int argc, char **argv) {
+#ifdef CHEMIKAZE_WITH_SERVER
+	long cpuCnt = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned workerCnt = cpuCnt > 1 ? cpuCnt - 1 : 0;
+	static const struct option options[] = {
+		{"workers", required_argument, nullptr, 'w'},
+		{},
+	};
+	for (int opt; (opt = getopt_long(argc, argv, "", options, nullptr)) != -1;) {
+		if (opt != 'w') {
+			printUsage();
+			return 1;
+		}
+		char *numEnd;
+		workerCnt = strtoul(optarg, &numEnd, 10);
+		if (*numEnd != '\0') {
+			fprintf(stderr, "--workers must be a number, got: %s\n", optarg);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		printUsage();
+		return 1;
+	}
+	return serve(argv[optind], workerCnt);
+#else
+	(void) argc, (void) argv;
+	fprintf(stderr, "Chemikaze was built without the server, it requires Linux (epoll)\n");
+	return 1;
+#endif
+}
+
+int main(int argc, char **argv) {
 	register_signals();
-	if (argc <= 1) {
-		fprintf(stderr, "Provider the file with Molecular Formulas as the 1st parameter\n");
+	if (argc > 1 && strcmp(argv[1], "serve") == 0)
+		return mainServe(argc - 1, argv + 1);
+	TabularMfCtx tabular = {.column = 0};
+	bool isTabular = false, hasTabularOptions = false;
+	static const struct option options[] = {
+		{"csv", no_argument, nullptr, 'c'},
+		{"tsv", no_argument, nullptr, 't'},
+		{"column", required_argument, nullptr, 'n'},
+		{"header", no_argument, nullptr, 'h'},
+		{"append", no_argument, nullptr, 'a'},
+		{},
+	};
+	for (int opt; (opt = getopt_long(argc, argv, "", options, nullptr)) != -1;) {
+		switch (opt) {
+			case 'c': isTabular = true; tabular.delimiter = ','; tabular.quote = '"'; break;
+			case 't': isTabular = true; tabular.delimiter = '\t'; tabular.quote = '\0'; break;
+			case 'h': tabular.header = hasTabularOptions = true; break;
+			case 'a': tabular.append = hasTabularOptions = true; break;
+			case 'n': {
+				char *numEnd;
+				unsigned long column = strtoul(optarg, &numEnd, 10);
+				if (*numEnd != '\0' || column == 0) {
+					fprintf(stderr, "--column must be a positive number, got: %s\n", optarg);
+					exit(1);
+				}
+				tabular.column = column - 1;
+				hasTabularOptions = true;
+				break;
+			}
+			default: printUsage(); exit(1);
+		}
+	}
+	if (optind >= argc) {
+		printUsage();
+		exit(1);
+	}
+	if (hasTabularOptions && !isTabular) {
+		fprintf(stderr, "--column, --header and --append require --csv or --tsv\n");
+		printUsage();
 		exit(1);
 	}
+	char *filepath = argv[optind];
+	if (isTabular)
+		return parseTabular(filepath, &tabular);
+	MfFileFormat format = detectMfFileFormat(filepath);
+	if (format != MF_FILE_PLAIN)
+		return benchmarkStreamed(filepath, format);
 	char *buf = nullptr;
-	size_t size = readAllBytes(argv[1], &buf);
+	size_t size = readAllBytes(filepath, &buf);
 
 	int repeats = 50;
 	// Go through the data once to calculate MF end and start offsets, so that these calcs aren't part of the benchmark:
@@ -0,0 +1,81 @@
+#include "csv.h"
+
+#include <string.h>
+
+// memchr() is vectorized in the standard libraries, so there's no need to scan 16/32 bytes at a time ourselves
+static const char* findOrEnd(const char *p, const char *end, char c) {
+	const char *found = memchr(p, c, end - p);
+	return found ? found : end;
+}
+
+// @return the quote that closes a quoted field whose content starts at `p`, or `end`
+static const char* findClosingQuote(const char *p, const char *end, char quote) {
+	while ((p = findOrEnd(p, end, quote)) + 1 < end && p[1] == quote)
+		p += 2;// escaped quote
+	return p;
+}
+
+/**
+ * Finds the bounds of the field that starts at `p`.
+ * @param closed set to false if the field is quoted, but the row ends before the closing quote
+ * @return the delimiter after the field, or `rowEnd`
+ */
+static const char* skipField(const char *p, const char *rowEnd, char delimiter, char quote,
+							 const char **start, const char **end, bool *closed) {
+	*closed = true;
+	if (!quote || p == rowEnd || *p != quote) {
+		*start = p;
+		return *end = findOrEnd(p, rowEnd, delimiter);
+	}
+	const char *closingQuote = findClosingQuote(p + 1, rowEnd, quote);
+	*closed = closingQuote < rowEnd;
+	*start = p + 1;
+	*end = closingQuote;
+	return findOrEnd(closingQuote, rowEnd, delimiter);
+}
+
+bool csv_findField(const char *row, const char *rowEnd, char delimiter, char quote, unsigned column,
+				   const char **fieldStart, const char **fieldEnd) {
+	bool closed;
+	for (const char *p = row;; p++/*skip the delimiter*/) {
+		p = skipField(p, rowEnd, delimiter, quote, fieldStart, fieldEnd, &closed);
+		if (column-- == 0)
+			return closed;
+		if (p == rowEnd)
+			return false;
+	}
+}
+
+unsigned csv_countFields(const char *row, const char *rowEnd, char delimiter, char quote) {
+	const char *start, *end;
+	bool closed;
+	unsigned cnt = 1;
+	for (const char *p = row; (p = skipField(p, rowEnd, delimiter, quote, &start, &end, &closed)) < rowEnd; p++)
+		cnt++;
+	return cnt;
+}
+
+bool csv_isQuoteOpenAtEnd(const char *line, const char *lineEnd, char delimiter, char quote, bool openAtStart) {
+	if (!quote || memchr(line, quote, lineEnd - line) == nullptr)
+		return openAtStart;// the most common case - no need to go field by field
+	const char *p = line, *start, *end;
+	if (openAtStart) { // the line starts in the middle of a quoted field
+		if ((p = findClosingQuote(p, lineEnd, quote)) == lineEnd)
+			return true;
+		if ((p = findOrEnd(p, lineEnd, delimiter)) == lineEnd)
+			return false;
+		p++;
+	}
+	bool closed;
+	for (;; p++) {
+		p = skipField(p, lineEnd, delimiter, quote, &start, &end, &closed);
+		if (!closed)
+			return true;
+		if (p == lineEnd)
+			return false;
+	}
+}
+
+bool csv_isRowComplete(const char *row, const char *rowEnd, char delimiter, char quote) {
+	return !csv_isQuoteOpenAtEnd(row, rowEnd, delimiter, quote, false);
+}
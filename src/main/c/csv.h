@@ -0,0 +1,34 @@
+#ifndef ELSCI_CHEMIKAZE_CSV_H
+#define ELSCI_CHEMIKAZE_CSV_H
+
+/*
+ * Functions to find fields in a single CSV/TSV row without copying anything.
+ *
+ * A field that starts with `quote` ends at the next lone `quote` (`""` inside is an escaped quote and is kept as is
+ * in the bounds), and the quotes themselves are excluded from the bounds. A quoted field may contain line breaks,
+ * in which case the row must be joined with the next lines until `csv_isRowComplete()`.
+ *
+ * `delimiter` is usually `,` or `\t`, `quote` is usually `"` for CSV and `\0` for TSV which means there's no quoting.
+ * `rowEnd` is always exclusive.
+ */
+
+/**
+ * @param column 0-based index of the field
+ * @param fieldStart receives the start of the field
+ * @param fieldEnd receives the end of the field, exclusive
+ * @return false if the row has fewer columns, or if the field's closing quote is missing
+ */
+bool csv_findField(const char *row, const char *rowEnd, char delimiter, char quote, unsigned column,
+				   const char **fieldStart, const char **fieldEnd);
+unsigned csv_countFields(const char *row, const char *rowEnd, char delimiter, char quote);
+// False if the last quoted field isn't closed, meaning that the row continues on the next line.
+bool csv_isRowComplete(const char *row, const char *rowEnd, char delimiter, char quote);
+/**
+ * Same as `csv_isRowComplete()`, but for a row that's read line by line: only the new line is scanned, and the state
+ * of the previous lines is passed in `openAtStart`.
+ *
+ * @param openAtStart whether the previous lines ended inside a quoted field
+ * @return whether this line ends inside a quoted field
+ */
+bool csv_isQuoteOpenAtEnd(const char *line, const char *lineEnd, char delimiter, char quote, bool openAtStart);
+#endif //ELSCI_CHEMIKAZE_CSV_H
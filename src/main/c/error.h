@@ -6,6 +6,7 @@ typedef enum {
 	PARSE,
 	OOM,
 	NULL_POINTER,
+	IO,
 } ChemikazeErrorCode;
 
 typedef struct {
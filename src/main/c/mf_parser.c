@@ -12,6 +12,14 @@
 
 constexpr unsigned MF_PUNCTUATION_LEN = 7;
 constexpr char MF_PUNCTUATION[MF_PUNCTUATION_LEN] = {'(', ')', '+', '-', '.', '[', ']'};
+// H, C, O, N, P, F, S, Br, Cl - these go first in `EARTH_SYMBOLS`, so their ChemElement are 0..8
+constexpr unsigned ORGANIC_ELEMENT_CNT = 9;
+// `[big letter - 'A'][small letter - 'a' + 1, or 0 if there's no small letter] -> ChemElement + 1`, 0 means that
+// the symbol isn't organic (or doesn't exist at all).
+constexpr ChemElement ORGANIC_SYMBOLS[26][27] = {
+	['H'-'A'][0]=1, ['C'-'A'][0]=2, ['O'-'A'][0]=3, ['N'-'A'][0]=4, ['P'-'A'][0]=5, ['F'-'A'][0]=6, ['S'-'A'][0]=7,
+	['B'-'A']['r'-'a'+1]=8, ['C'-'A']['l'-'a'+1]=9,
+};
 
 bool isBigLetter(char c) {
 	return 'A' <= c && c <= 'Z';
@@ -112,9 +120,10 @@ ChemikazeError* findAndApplyGroupCoeffs(const char *mf, const char *mfEnd/*exclu
 		scaleForward(mf, mfEnd, i, currStackDepth, resultCoeffs, consumeCoeff(&i, mfEnd));
 		if (i == mfEnd)
 			break;
-		while (isAlphanumeric(*i)) // skip all letters, numbers, dots
-			if (i++ >= mfEnd)
-				goto out;
+		while (i < mfEnd && isAlphanumeric(*i)) // skip all letters, numbers, dots
+			i++;
+		if (i == mfEnd)
+			break;// mfEnd may point to the next MF, or to garbage - mustn't look at it
 		if (*i == '(')
 			currStackDepth++;
 		else if (*i == ')') {
@@ -125,12 +134,33 @@ ChemikazeError* findAndApplyGroupCoeffs(const char *mf, const char *mfEnd/*exclu
 		}
 		i++;// happens on these: (.[]+
 	}
-out:
 	if (currStackDepth)
 		return ChemikazeError_newParsing("The opening and closing parentheses don't match.", mf, mfEnd - mf);
 	return nullptr;
 }
 
+/**
+ * The fast path for the most common MFs like {@code C6H5Br} that consist only of the organic elements with their
+ * coefficients. No temporary arrays, no hash lookups.
+ *
+ * @param counts accumulates the counts of organic elements, indexed by ChemElement
+ * @return false as soon as anything else shows up (other elements, parentheses, dots, group coefficients, errors),
+ *         in which case `counts` are garbage and the MF must go through the general engine
+ */
+bool parseOrganicMf(const char *mf, const char *mfEnd, unsigned counts[static ORGANIC_ELEMENT_CNT]) {
+	for (const char *i = mf; i < mfEnd;) {
+		if (!isBigLetter(*i))
+			return false;
+		bool twoLetters = i + 1 < mfEnd && isSmallLetter(i[1]);
+		ChemElement elementPlus1 = ORGANIC_SYMBOLS[*i - 'A'][twoLetters ? i[1] - 'a' + 1 : 0];
+		if (elementPlus1 == 0)
+			return false;
+		i += 1 + twoLetters;
+		counts[elementPlus1 - 1] += consumeCoeff(&i, mfEnd);
+	}
+	return true;
+}
+
 AtomCounts* combineIntoAtomCounts(const ChemElement *elements, const unsigned *coeffs, size_t len, AtomCounts *result) {
 	for (size_t i = 0; i < len; i++)
 		if (coeffs[i] > 0)
@@ -156,6 +186,15 @@ AtomCounts* parseMfChunk(const char *mf, const char *mfEnd, ChemikazeError **err
 		*error = ChemikazeError_new(PARSE, Chemikaze_toString("Empty Molecular Formula"));
 		return nullptr;
 	}
+	unsigned organicCounts[ORGANIC_ELEMENT_CNT] = {};
+	if (parseOrganicMf(mf, mfEnd, organicCounts)) {
+		if ((result = AtomCounts_new()) == nullptr) {
+			*error = ChemikazeError_new(OOM, nullptr);
+			return nullptr;
+		}
+		memcpy(result->counts, organicCounts, sizeof(organicCounts));
+		return result;
+	}
 	size_t mfLen = mfEnd - mf;
 	unsigned coeff[mfLen] = {};
 	ChemElement elements[mfLen] = {};
@@ -0,0 +1,311 @@
+#include "mf_stream.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CHEMIKAZE_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CHEMIKAZE_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "error.h"
+
+// ------------------------------------------------------------------------------------------------ Line splitting
+
+void MfLineSplitter_init(MfLineSplitter *s, MfLineConsumer consumer, void *ctx) {
+	*s = (MfLineSplitter) {.consumer = consumer, .ctx = ctx};
+}
+void MfLineSplitter_free(MfLineSplitter *s) {
+	free(s->carry);
+	s->carry = nullptr;
+	s->carryLen = s->carryCap = 0;
+}
+
+static ChemikazeError* appendToCarry(MfLineSplitter *s, const char *start, const char *end) {
+	size_t len = end - start;
+	if (len == 0) // e.g. the block ended with `\n`, and carry may still be unallocated
+		return nullptr;
+	if (s->carryLen + len > s->carryCap) {
+		size_t newCap = s->carryCap ? s->carryCap * 2 : 256;
+		while (newCap < s->carryLen + len)
+			newCap *= 2;
+		char *newCarry = realloc(s->carry, newCap);
+		if (newCarry == nullptr)
+			return ChemikazeError_new(OOM, Chemikaze_toString("Couldn't grow the buffer for a partial line"));
+		s->carry = newCarry;
+		s->carryCap = newCap;
+	}
+	memcpy(s->carry + s->carryLen, start, len);
+	s->carryLen += len;
+	return nullptr;
+}
+
+ChemikazeError* MfLineSplitter_feed(MfLineSplitter *s, const char *block, size_t len) {
+	const char *end = block + len, *lineStart = block;
+	for (const char *nl; (nl = memchr(lineStart, '\n', end - lineStart)) != nullptr; lineStart = nl + 1) {
+		if (s->carryLen == 0) { // the whole line is inside the block, no need to copy it
+			s->consumer(lineStart, nl, s->ctx);
+			continue;
+		}
+		ChemikazeError *error = appendToCarry(s, lineStart, nl);
+		if (error)
+			return error;
+		s->consumer(s->carry, s->carry + s->carryLen, s->ctx);
+		s->carryLen = 0;
+	}
+	return appendToCarry(s, lineStart, end);// the line continues in the next block
+}
+void MfLineSplitter_finish(MfLineSplitter *s) {
+	if (s->carryLen)
+		s->consumer(s->carry, s->carry + s->carryLen, s->ctx);
+	s->carryLen = 0;
+}
+
+// ------------------------------------------------------------------------------------------------ Decompression
+
+MfFileFormat detectMfFileFormat(const char *filepath) {
+	size_t len = strlen(filepath);
+	if (len > 3 && strcmp(filepath + len - 3, ".gz") == 0)
+		return MF_FILE_GZIP;
+	if (len > 4 && strcmp(filepath + len - 4, ".zst") == 0)
+		return MF_FILE_ZSTD;
+	return MF_FILE_PLAIN;
+}
+
+typedef struct {
+	MfFileFormat format;
+	FILE *f;
+#ifdef CHEMIKAZE_WITH_ZLIB
+	gzFile gz;
+#endif
+#ifdef CHEMIKAZE_WITH_ZSTD
+	ZSTD_DStream *zstd;
+	void *zstdInData;
+	ZSTD_inBuffer zstdIn;
+	size_t zstdLastRet;// 0 means the last frame was fully decoded
+#endif
+} MfDecoder;
+
+static ChemikazeError* ioError(const char *msg, const char *filepath) {
+	char *fullMsg = malloc(strlen(msg) + strlen(filepath) + 3);
+	sprintf(fullMsg, "%s: %s", msg, filepath);
+	return ChemikazeError_new(IO, fullMsg);
+}
+
+static ChemikazeError* MfDecoder_open(MfDecoder *d, const char *filepath, MfFileFormat format) {
+	*d = (MfDecoder) {.format = format};
+	switch (format) {
+		case MF_FILE_GZIP:
+#ifdef CHEMIKAZE_WITH_ZLIB
+			if ((d->gz = gzopen(filepath, "rb")) == nullptr)
+				return ioError("Couldn't open the file", filepath);
+			gzbuffer(d->gz, MF_STREAM_BLOCK_SIZE / 4);
+			return nullptr;
+#else
+			return ioError("Chemikaze was built without zlib, can't read", filepath);
+#endif
+		case MF_FILE_ZSTD:
+#ifdef CHEMIKAZE_WITH_ZSTD
+			if ((d->f = fopen(filepath, "rb")) == nullptr)
+				return ioError("Couldn't open the file", filepath);
+			d->zstd = ZSTD_createDStream();
+			d->zstdInData = malloc(ZSTD_DStreamInSize());
+			if (d->zstd == nullptr || d->zstdInData == nullptr)
+				return ChemikazeError_new(OOM, Chemikaze_toString("Couldn't allocate the zstd decoder"));
+			ZSTD_initDStream(d->zstd);
+			d->zstdIn = (ZSTD_inBuffer) {.src = d->zstdInData};
+			return nullptr;
+#else
+			return ioError("Chemikaze was built without zstd, can't read", filepath);
+#endif
+		case MF_FILE_PLAIN:
+			if ((d->f = fopen(filepath, "rb")) == nullptr)
+				return ioError("Couldn't open the file", filepath);
+			return nullptr;
+	}
+	return nullptr;
+}
+static void MfDecoder_close(MfDecoder *d) {
+#ifdef CHEMIKAZE_WITH_ZLIB
+	if (d->gz)
+		gzclose(d->gz);
+#endif
+#ifdef CHEMIKAZE_WITH_ZSTD
+	ZSTD_freeDStream(d->zstd);
+	free(d->zstdInData);
+#endif
+	if (d->f)
+		fclose(d->f);
+}
+
+/**
+ * Fills `dst` with decompressed bytes. Always fills it completely unless the end of the file is reached, so
+ * returning less than `cap` means there's nothing more to read.
+ */
+static size_t MfDecoder_read(MfDecoder *d, char *dst, size_t cap, ChemikazeError **error) {
+	size_t len = 0;
+	switch (d->format) {
+		case MF_FILE_PLAIN:
+			while (len < cap && !feof(d->f) && !ferror(d->f))
+				len += fread(dst + len, 1, cap - len, d->f);
+			if (ferror(d->f))
+				*error = ChemikazeError_new(IO, Chemikaze_toString("Error reading the file"));
+			return len;
+		case MF_FILE_GZIP:
+#ifdef CHEMIKAZE_WITH_ZLIB
+			while (len < cap) {
+				int read = gzread(d->gz, dst + len, cap - len);
+				if (read < 0) {
+					int errnum;
+					*error = ChemikazeError_new(IO, Chemikaze_toString(gzerror(d->gz, &errnum)));
+					break;
+				}
+				if (read == 0) { // either the end of the file, or a truncated file
+					int errnum;
+					const char *msg = gzerror(d->gz, &errnum);
+					if (errnum != Z_OK)
+						*error = ChemikazeError_new(IO, Chemikaze_toString(msg));
+					break;
+				}
+				len += read;
+			}
+#endif
+			return len;
+		case MF_FILE_ZSTD: {
+#ifdef CHEMIKAZE_WITH_ZSTD
+			ZSTD_outBuffer out = {.dst = dst, .size = cap};
+			while (out.pos < out.size) {
+				if (d->zstdIn.pos == d->zstdIn.size) {
+					d->zstdIn.size = fread(d->zstdInData, 1, ZSTD_DStreamInSize(), d->f);
+					d->zstdIn.pos = 0;
+					if (ferror(d->f))
+						*error = ChemikazeError_new(IO, Chemikaze_toString("Error reading the file"));
+					else if (d->zstdIn.size == 0 && d->zstdLastRet != 0)
+						*error = ChemikazeError_new(IO, Chemikaze_toString("Truncated zstd file"));
+					if (d->zstdIn.size == 0)
+						break;
+				}
+				size_t ret = ZSTD_decompressStream(d->zstd, &out, &d->zstdIn);
+				if (ZSTD_isError(ret)) {
+					*error = ChemikazeError_new(IO, Chemikaze_toString(ZSTD_getErrorName(ret)));
+					break;
+				}
+				d->zstdLastRet = ret;
+			}
+			len = out.pos;
+#endif
+			return len;
+		}
+	}
+	return len;
+}
+
+// ------------------------------------------------------------------------------------------------ Double buffering
+
+typedef struct {
+	char *data;
+	size_t len;
+	bool full;// filled by the decompressing thread, but not yet processed by the parsing thread
+} MfBlock;
+
+typedef struct {
+	MfDecoder decoder;
+	MfBlock blocks[2];
+	bool eof;      // the decompressing thread won't fill any more blocks
+	bool cancelled;// the parsing thread won't take any more blocks
+	ChemikazeError *error;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} MfStream;
+
+static void* decompressBlocks(void *arg) {
+	MfStream *s = arg;
+	for (unsigned i = 0;; i ^= 1) {
+		MfBlock *b = &s->blocks[i];
+		pthread_mutex_lock(&s->lock);
+		while (b->full && !s->cancelled)
+			pthread_cond_wait(&s->changed, &s->lock);
+		bool cancelled = s->cancelled;
+		pthread_mutex_unlock(&s->lock);
+		if (cancelled)
+			return nullptr;
+
+		ChemikazeError *error = nullptr;
+		size_t len = MfDecoder_read(&s->decoder, b->data, MF_STREAM_BLOCK_SIZE, &error);
+
+		pthread_mutex_lock(&s->lock);
+		b->len = len;
+		b->full = len > 0;
+		bool eof = s->eof = error != nullptr || len < MF_STREAM_BLOCK_SIZE;
+		s->error = error;
+		pthread_cond_broadcast(&s->changed);
+		pthread_mutex_unlock(&s->lock);
+		if (eof)
+			return nullptr;
+	}
+}
+
+static ChemikazeError* splitBlocks(MfStream *s, MfLineSplitter *splitter) {
+	for (unsigned i = 0;; i ^= 1) {
+		MfBlock *b = &s->blocks[i];
+		pthread_mutex_lock(&s->lock);
+		while (!b->full && !s->eof)
+			pthread_cond_wait(&s->changed, &s->lock);
+		bool hasData = b->full;
+		pthread_mutex_unlock(&s->lock);
+		if (!hasData) // blocks are filled in order, so if this one is empty after EOF - there's nothing left
+			return nullptr;
+
+		ChemikazeError *error = MfLineSplitter_feed(splitter, b->data, b->len);
+
+		pthread_mutex_lock(&s->lock);
+		b->full = false;
+		s->cancelled = error != nullptr;
+		pthread_cond_broadcast(&s->changed);
+		pthread_mutex_unlock(&s->lock);
+		if (error)
+			return error;
+	}
+}
+
+ChemikazeError* readMfLines(const char *filepath, MfFileFormat format, MfLineConsumer consumer, void *ctx) {
+	MfStream s = {};
+	ChemikazeError *error = MfDecoder_open(&s.decoder, filepath, format);
+	if (error)
+		goto closeDecoder;
+	for (unsigned i = 0; i < 2; i++)
+		if ((s.blocks[i].data = malloc(MF_STREAM_BLOCK_SIZE)) == nullptr) {
+			error = ChemikazeError_new(OOM, Chemikaze_toString("Couldn't allocate the stream blocks"));
+			goto freeBlocks;
+		}
+	pthread_mutex_init(&s.lock, nullptr);
+	pthread_cond_init(&s.changed, nullptr);
+
+	pthread_t decompressor;
+	if (pthread_create(&decompressor, nullptr, decompressBlocks, &s) != 0) {
+		error = ChemikazeError_new(IO, Chemikaze_toString("Couldn't start the decompressing thread"));
+		goto destroyLock;
+	}
+	MfLineSplitter splitter;
+	MfLineSplitter_init(&splitter, consumer, ctx);
+	error = splitBlocks(&s, &splitter);
+	pthread_join(decompressor, nullptr);
+	if (error == nullptr && (error = s.error) == nullptr)
+		MfLineSplitter_finish(&splitter);
+	else if (s.error != error && s.error != nullptr)
+		ChemikazeError_free(s.error);
+	MfLineSplitter_free(&splitter);
+destroyLock:
+	pthread_cond_destroy(&s.changed);
+	pthread_mutex_destroy(&s.lock);
+freeBlocks:
+	free(s.blocks[0].data);
+	free(s.blocks[1].data);
+closeDecoder:
+	MfDecoder_close(&s.decoder);
+	return error;
+}
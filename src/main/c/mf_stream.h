@@ -0,0 +1,48 @@
+#ifndef ELSCI_CHEMIKAZE_MF_STREAM_H
+#define ELSCI_CHEMIKAZE_MF_STREAM_H
+#include <stddef.h>
+
+#include "error.h"
+
+// Size of each of the two blocks that the decompressing thread hands over to the parsing thread.
+#define MF_STREAM_BLOCK_SIZE (1 << 20)
+
+typedef enum {
+	MF_FILE_PLAIN,
+	MF_FILE_GZIP,
+	MF_FILE_ZSTD,
+} MfFileFormat;
+
+/**
+ * Receives one line (without the `\n`). The bounds point either into the current block or into the splitter's
+ * carry buffer, so they are valid only until the consumer returns.
+ */
+typedef void (*MfLineConsumer)(const char *start, const char *end/*exclusive*/, void *ctx);
+
+/**
+ * Splits a stream of blocks into lines. Lines that lie fully inside a block are passed to the consumer without
+ * copying; a line that crosses block boundaries is accumulated in `carry` until its `\n` shows up.
+ */
+typedef struct {
+	MfLineConsumer consumer;
+	void *ctx;
+	char *carry;
+	size_t carryLen, carryCap;
+} MfLineSplitter;
+
+void MfLineSplitter_init(MfLineSplitter *s, MfLineConsumer consumer, void *ctx);
+ChemikazeError* MfLineSplitter_feed(MfLineSplitter *s, const char *block, size_t len);
+// Passes the last line to the consumer if the input didn't end with `\n`.
+void MfLineSplitter_finish(MfLineSplitter *s);
+void MfLineSplitter_free(MfLineSplitter *s);
+
+// Guesses the format by the file extension: `.gz` or `.zst`, anything else is read as is.
+MfFileFormat detectMfFileFormat(const char *filepath);
+/**
+ * Reads (and decompresses if needed) the file in a separate thread while the calling thread splits the blocks into
+ * lines and passes them to the consumer. So decompression of the next block overlaps with parsing of the current one.
+ *
+ * @return nullptr on success, otherwise the error owned by the caller
+ */
+ChemikazeError* readMfLines(const char *filepath, MfFileFormat format, MfLineConsumer consumer, void *ctx);
+#endif //ELSCI_CHEMIKAZE_MF_STREAM_H
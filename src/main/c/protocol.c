@@ -0,0 +1,80 @@
+#include "protocol.h"
+
+#include <string.h>
+
+#include "AtomCounts.h"
+#include "error.h"
+#include "mf_parser.h"
+#include "periodic_table.h"
+
+uint32_t protocol_get32(const char *src) {
+	const unsigned char *b = (const unsigned char *) src;
+	return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
+}
+void protocol_put32(char *dst, uint32_t val) {
+	for (unsigned i = 0; i < 4; i++, val >>= 8)
+		dst[i] = (char) (val & 0xFF);
+}
+
+static void writeHeader(char *dst, size_t frameSize, uint32_t id, ProtocolStatus status) {
+	protocol_put32(dst, frameSize - PROTOCOL_LEN_SIZE);
+	protocol_put32(dst + 4, id);
+	dst[8] = (char) status;
+}
+
+size_t protocol_writeResponse(uint32_t id, ProtocolStatus status, const char *body, size_t bodyLen,
+							  char *dst, size_t cap) {
+	if (PROTOCOL_HEADER_SIZE + bodyLen > cap)
+		bodyLen = cap - PROTOCOL_HEADER_SIZE;
+	memcpy(dst + PROTOCOL_HEADER_SIZE, body, bodyLen);
+	writeHeader(dst, PROTOCOL_HEADER_SIZE + bodyLen, id, status);
+	return PROTOCOL_HEADER_SIZE + bodyLen;
+}
+
+ProtocolFrameStatus protocol_readRequest(const char *buf, size_t bufLen, ProtocolRequest *request, size_t *frameSize) {
+	if (bufLen < PROTOCOL_LEN_SIZE)
+		return PROTOCOL_FRAME_INCOMPLETE;
+	uint32_t len = protocol_get32(buf);
+	if (len < PROTOCOL_HEADER_SIZE - PROTOCOL_LEN_SIZE || len > PROTOCOL_MAX_FRAME_LEN)
+		return PROTOCOL_FRAME_BROKEN;
+	if (bufLen < PROTOCOL_LEN_SIZE + len)
+		return PROTOCOL_FRAME_INCOMPLETE;
+	request->id = protocol_get32(buf + 4);
+	request->op = (uint8_t) buf[8];
+	request->mf = buf + PROTOCOL_HEADER_SIZE;
+	request->mfEnd = buf + PROTOCOL_LEN_SIZE + len;
+	*frameSize = PROTOCOL_LEN_SIZE + len;
+	return PROTOCOL_FRAME_OK;
+}
+
+size_t protocol_writeError(uint32_t id, uint8_t code, const char *msg, char *dst) {
+	char body[PROTOCOL_MAX_RESPONSE_SIZE];
+	body[0] = (char) code;
+	size_t msgLen = msg ? strlen(msg) : 0;
+	if (msgLen > sizeof(body) - 1)
+		msgLen = sizeof(body) - 1;
+	if (msgLen)
+		memcpy(body + 1, msg, msgLen);
+	return protocol_writeResponse(id, PROTOCOL_ERROR, body, 1 + msgLen, dst, PROTOCOL_MAX_RESPONSE_SIZE);
+}
+
+size_t protocol_writeParseResponse(uint32_t id, const char *mf, const char *mfEnd, char *dst) {
+	ChemikazeError *error = nullptr;
+	AtomCounts *counts = parseMfChunk(mf, mfEnd, &error);
+	if (error) {
+		size_t len = protocol_writeError(id, error->code, error->msg, dst);
+		ChemikazeError_free(error);
+		return len;
+	}
+	char *pos = dst + PROTOCOL_HEADER_SIZE;
+	for (ChemElement e = 0; e < EARTH_ELEMENT_CNT; e++) {
+		if (counts->counts[e] == 0)
+			continue;
+		*pos++ = (char) e;
+		protocol_put32(pos, counts->counts[e]);
+		pos += 4;
+	}
+	AtomCounts_free(counts);
+	writeHeader(dst, pos - dst, id, PROTOCOL_OK);
+	return pos - dst;
+}
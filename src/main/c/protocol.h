@@ -0,0 +1,77 @@
+#ifndef ELSCI_CHEMIKAZE_PROTOCOL_H
+#define ELSCI_CHEMIKAZE_PROTOCOL_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary protocol of `chemikaze serve`. Every message is a frame, all integers are unsigned little-endian:
+ *
+ *   request:  u32 len | u32 id | u8 op     | MF (len - 5 bytes)
+ *   response: u32 len | u32 id | u8 status | body (len - 5 bytes)
+ *
+ * `len` is the size of everything after it. `id` is chosen by the client and is returned as is, responses within a
+ * connection come in the same order as the requests. The body depends on the op and status:
+ *   - PROTOCOL_OP_PARSE + PROTOCOL_OK: (u8 ChemElement, u32 count) for every element with a non-zero count
+ *   - PROTOCOL_OP_STATS + PROTOCOL_OK: human-readable server counters
+ *   - PROTOCOL_ERROR: u8 error code | error message, where the code is either ChemikazeErrorCode for parsing errors,
+ *     or one of ProtocolErrorCode for the errors in the request itself
+ *
+ * A frame with `len` outside of [5, PROTOCOL_MAX_FRAME_LEN] means the stream is broken, and the server closes the
+ * connection.
+ */
+#define PROTOCOL_LEN_SIZE 4
+#define PROTOCOL_HEADER_SIZE 9 // len + id + op/status
+#define PROTOCOL_MAX_FRAME_LEN (64 * 1024)
+// Fits counts of all the elements, longer error messages are truncated to fit.
+#define PROTOCOL_MAX_RESPONSE_SIZE 512
+
+typedef enum {
+	PROTOCOL_OP_PARSE = 0,
+	PROTOCOL_OP_STATS = 1,
+} ProtocolOp;
+
+typedef enum {
+	PROTOCOL_OK = 0,
+	PROTOCOL_ERROR = 1,
+} ProtocolStatus;
+
+// Start high so that they don't clash with ChemikazeErrorCode.
+typedef enum {
+	PROTOCOL_UNKNOWN_OP = 128,
+} ProtocolErrorCode;
+
+typedef struct {
+	uint32_t id;
+	uint8_t op;
+	const char *mf, *mfEnd;// point into the buffer that the request was read from
+} ProtocolRequest;
+
+typedef enum {
+	PROTOCOL_FRAME_OK,
+	PROTOCOL_FRAME_INCOMPLETE,// need more bytes
+	PROTOCOL_FRAME_BROKEN,    // `len` is invalid, there's no way to find where the next frame starts
+} ProtocolFrameStatus;
+
+uint32_t protocol_get32(const char *src);
+void protocol_put32(char *dst, uint32_t val);
+
+/**
+ * Reads the request frame at the start of `buf`.
+ *
+ * @param frameSize receives the size of the whole frame if it's complete, that's where the next frame starts
+ */
+ProtocolFrameStatus protocol_readRequest(const char *buf, size_t bufLen, ProtocolRequest *request, size_t *frameSize);
+
+/**
+ * Parses the MF and writes the whole response frame into `dst`.
+ *
+ * @param dst must fit at least PROTOCOL_MAX_RESPONSE_SIZE bytes
+ * @return the size of the frame
+ */
+size_t protocol_writeParseResponse(uint32_t id, const char *mf, const char *mfEnd, char *dst);
+// Writes PROTOCOL_ERROR frame, `code` is either ChemikazeErrorCode or ProtocolErrorCode.
+size_t protocol_writeError(uint32_t id, uint8_t code, const char *msg, char *dst);
+// Writes a frame with an arbitrary body, which is truncated if the whole frame doesn't fit into `cap`.
+size_t protocol_writeResponse(uint32_t id, ProtocolStatus status, const char *body, size_t bodyLen,
+							  char *dst, size_t cap);
+#endif //ELSCI_CHEMIKAZE_PROTOCOL_H
@@ -0,0 +1,572 @@
+#define _GNU_SOURCE // accept4()
+#include "server.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+#define MAX_EVENTS 256
+// Smaller batches are parsed right in the I/O thread, waking up the workers would take longer than parsing.
+#define PARALLEL_BATCH_MIN 64
+#define READ_CHUNK (64 * 1024)
+// A client that pipelines a lot of requests gets only part of them answered in one round, so that it can't occupy
+// the I/O thread and the memory for jobs alone. The rest stay in its input until the next rounds.
+#define MAX_JOBS_PER_CONNECTION 1024
+#define MAX_BATCH_JOBS (16 * MAX_JOBS_PER_CONNECTION)
+#define MIN_JOB_CAP 1024
+// Stop reading from a client that doesn't read its responses, otherwise they'd pile up in memory.
+#define OUT_HIGH_WATER_MARK (1024 * 1024)
+#define LATENCY_BUCKET_CNT 1024 // 1µs each, the last one also holds everything slower
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop([[maybe_unused]] int sig) {
+	stopRequested = 1;
+}
+
+// ------------------------------------------------------------------------------------------------ Data
+
+typedef struct Connection {
+	int fd;
+	char *in;
+	size_t inLen, inCap;
+	size_t consumed;// how much of the input went into the current batch
+	char *out;// responses that didn't fit into the socket yet
+	size_t outLen, outCap;
+	uint32_t events;// what epoll currently waits for
+	bool closing;
+	bool touched;// already in the current round
+	struct Connection *next;// in the list of the connections touched in this round, or in the backlog
+} Connection;
+
+typedef struct {
+	Connection *conn;
+	uint64_t receivedNs;
+	uint32_t id;
+	uint8_t op;
+	const char *mf, *mfEnd;// points into Connection->in, which isn't touched until the batch is answered
+	size_t responseLen;
+	char response[PROTOCOL_MAX_RESPONSE_SIZE];
+} Job;
+
+typedef struct {
+	uint64_t connections, requests, errors, batches, bytesIn, bytesOut;
+	uint64_t latencyUs[LATENCY_BUCKET_CNT];// from reading the request to writing the response
+	uint64_t startedNs;
+} ServerStats;
+
+typedef struct {
+	unsigned workerCnt;
+	pthread_t *workers;
+	Job *jobs;
+	size_t jobCnt;
+	atomic_size_t nextJob;
+	uint64_t generation;// incremented with every batch given to the workers
+	unsigned busyWorkers;
+	bool stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t batchReady, batchDone;
+} WorkerPool;
+
+static uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ------------------------------------------------------------------------------------------------ Worker pool
+
+static void processJob(Job *j) {
+	if (j->op == PROTOCOL_OP_PARSE)
+		j->responseLen = protocol_writeParseResponse(j->id, j->mf, j->mfEnd, j->response);
+	else if (j->op != PROTOCOL_OP_STATS) // stats are filled by the I/O thread
+		j->responseLen = protocol_writeError(j->id, PROTOCOL_UNKNOWN_OP, "Unknown op", j->response);
+}
+static void processJobs(WorkerPool *p) {
+	for (size_t i; (i = atomic_fetch_add(&p->nextJob, 1)) < p->jobCnt;)
+		processJob(&p->jobs[i]);
+}
+
+static void* workerLoop(void *arg) {
+	WorkerPool *p = arg;
+	for (uint64_t seenGeneration = 0;;) {
+		pthread_mutex_lock(&p->lock);
+		while (p->generation == seenGeneration && !p->stopping)
+			pthread_cond_wait(&p->batchReady, &p->lock);
+		if (p->stopping) {
+			pthread_mutex_unlock(&p->lock);
+			return nullptr;
+		}
+		seenGeneration = p->generation;
+		pthread_mutex_unlock(&p->lock);
+
+		processJobs(p);
+
+		pthread_mutex_lock(&p->lock);
+		if (--p->busyWorkers == 0)
+			pthread_cond_signal(&p->batchDone);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+static void runBatch(WorkerPool *p, Job *jobs, size_t jobCnt) {
+	if (jobCnt < PARALLEL_BATCH_MIN || p->workerCnt == 0) {
+		for (size_t i = 0; i < jobCnt; i++)
+			processJob(&jobs[i]);
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->jobs = jobs;
+	p->jobCnt = jobCnt;
+	atomic_store(&p->nextJob, 0);
+	p->busyWorkers = p->workerCnt;// every worker takes part in every batch, so nobody is left with a stale one
+	p->generation++;
+	pthread_cond_broadcast(&p->batchReady);
+	pthread_mutex_unlock(&p->lock);
+
+	processJobs(p);
+
+	pthread_mutex_lock(&p->lock);
+	while (p->busyWorkers > 0)
+		pthread_cond_wait(&p->batchDone, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static bool WorkerPool_start(WorkerPool *p, unsigned workerCnt) {
+	*p = (WorkerPool) {};
+	pthread_mutex_init(&p->lock, nullptr);
+	pthread_cond_init(&p->batchReady, nullptr);
+	pthread_cond_init(&p->batchDone, nullptr);
+	if ((p->workers = calloc(workerCnt ? workerCnt : 1, sizeof(pthread_t))) == nullptr)
+		return false;
+	for (; p->workerCnt < workerCnt; p->workerCnt++)
+		if (pthread_create(&p->workers[p->workerCnt], nullptr, workerLoop, p) != 0)
+			return false;
+	return true;
+}
+static void WorkerPool_stop(WorkerPool *p) {
+	pthread_mutex_lock(&p->lock);
+	p->stopping = true;
+	pthread_cond_broadcast(&p->batchReady);
+	pthread_mutex_unlock(&p->lock);
+	for (unsigned i = 0; i < p->workerCnt; i++)
+		pthread_join(p->workers[i], nullptr);
+	free(p->workers);
+	pthread_cond_destroy(&p->batchDone);
+	pthread_cond_destroy(&p->batchReady);
+	pthread_mutex_destroy(&p->lock);
+}
+
+// ------------------------------------------------------------------------------------------------ Stats
+
+// Writes either `<=N` (the upper bound of the bucket), `>N` for the overflow bucket, or `=n/a` if there's no data.
+static const char* formatLatencyPercentile(const ServerStats *s, double percentile, char dst[static 16]) {
+	if (s->requests == 0)
+		return strcpy(dst, "=n/a");
+	uint64_t threshold = (uint64_t) (s->requests * percentile), seen = 0;
+	unsigned bucket = 0;
+	while (bucket < LATENCY_BUCKET_CNT - 1 && (seen += s->latencyUs[bucket]) <= threshold)
+		bucket++;
+	if (bucket == LATENCY_BUCKET_CNT - 1)
+		sprintf(dst, ">%u", LATENCY_BUCKET_CNT - 1);
+	else
+		sprintf(dst, "<=%u", bucket + 1);
+	return dst;
+}
+static size_t formatStats(const ServerStats *s, char *dst, size_t cap) {
+	double uptime = (double) (nowNs() - s->startedNs) / 1e9;
+	int len = snprintf(dst, cap,
+		"uptime_s=%.1f connections=%"PRIu64" requests=%"PRIu64" errors=%"PRIu64" batches=%"PRIu64" avg_batch=%.1f "
+		"requests_per_s=%.0f bytes_in=%"PRIu64" bytes_out=%"PRIu64" "
+		"latency_us_p50%s latency_us_p99%s latency_us_p999%s",
+		uptime, s->connections, s->requests, s->errors, s->batches,
+		s->batches ? (double) s->requests / s->batches : 0, s->requests / uptime, s->bytesIn, s->bytesOut,
+		formatLatencyPercentile(s, .5, (char[16]) {}), formatLatencyPercentile(s, .99, (char[16]) {}),
+		formatLatencyPercentile(s, .999, (char[16]) {}));
+	return len < 0 ? 0 : (size_t) len < cap ? (size_t) len : cap - 1;
+}
+
+// ------------------------------------------------------------------------------------------------ Connections
+
+static bool ensureCapacity(char **buf, size_t *cap, size_t needed) {
+	if (needed <= *cap)
+		return true;
+	size_t newCap = *cap ? *cap : READ_CHUNK;
+	while (newCap < needed)
+		newCap *= 2;
+	char *newBuf = realloc(*buf, newCap);
+	if (newBuf == nullptr)
+		return false;
+	*buf = newBuf;
+	*cap = newCap;
+	return true;
+}
+
+static void Connection_close(Connection *c) {
+	close(c->fd);// also removes it from epoll
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+// Stops or resumes waiting for new connections.
+static void setAccepting(int epollFd, int listenFd, bool accepting) {
+	struct epoll_event event = {.events = accepting ? EPOLLIN : 0, .data.ptr = nullptr};
+	epoll_ctl(epollFd, EPOLL_CTL_MOD, listenFd, &event);
+}
+
+/**
+ * If we run out of file descriptors, the pending connection stays in the backlog and the listening socket stays
+ * readable - epoll would keep returning it. So we stop accepting until one of the connections is closed.
+ *
+ * @return false if accepting was stopped
+ */
+static bool acceptAll(int epollFd, int listenFd, ServerStats *stats) {
+	for (;;) {
+		int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EMFILE && errno != ENFILE)
+				return true;
+			static bool reported = false;// it may happen on every closed connection, no need to flood the log
+			if (!reported)
+				perror("Couldn't accept a connection, not accepting new ones until some are closed");
+			reported = true;
+			setAccepting(epollFd, listenFd, false);
+			return false;
+		}
+		Connection *c = calloc(1, sizeof(Connection));
+		struct epoll_event event = {.events = EPOLLIN, .data.ptr = c};
+		if (c == nullptr || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+			perror("Couldn't register the connection");
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->events = EPOLLIN;
+		stats->connections++;
+	}
+}
+
+static void readAvailable(Connection *c, ServerStats *stats) {
+	if (!ensureCapacity(&c->in, &c->inCap, c->inLen + READ_CHUNK)) {
+		c->closing = true;
+		return;
+	}
+	ssize_t read = recv(c->fd, c->in + c->inLen, c->inCap - c->inLen, 0);
+	if (read > 0) {
+		c->inLen += read;
+		stats->bytesIn += read;
+	} else if (read == 0 || (errno != EAGAIN && errno != EINTR))
+		c->closing = true;
+}
+
+/**
+ * Turns complete frames from the connection's input into jobs. A partial frame, as well as the frames that didn't fit
+ * into `maxJobCnt`, stay in the buffer.
+ * @return the offset in the input buffer where the unprocessed bytes start
+ */
+static size_t extractJobs(Connection *c, Job **jobs, size_t *jobCnt, size_t *jobCap, size_t maxJobCnt) {
+	uint64_t now = nowNs();
+	size_t pos = 0, frameSize;
+	ProtocolRequest request;
+	for (ProtocolFrameStatus status; *jobCnt < maxJobCnt
+		 && (status = protocol_readRequest(c->in + pos, c->inLen - pos, &request, &frameSize)) != PROTOCOL_FRAME_INCOMPLETE;
+		 pos += frameSize) {
+		if (status == PROTOCOL_FRAME_BROKEN) {
+			c->closing = true;
+			return c->inLen;
+		}
+		if (*jobCnt == *jobCap) {
+			size_t newCap = *jobCap * 2 < MAX_BATCH_JOBS ? *jobCap * 2 : MAX_BATCH_JOBS;
+			Job *newJobs = realloc(*jobs, newCap * sizeof(Job));
+			if (newJobs == nullptr) {
+				c->closing = true;
+				return c->inLen;
+			}
+			*jobs = newJobs;
+			*jobCap = newCap;
+		}
+		Job *j = &(*jobs)[(*jobCnt)++];
+		j->conn = c;
+		j->receivedNs = now;
+		j->id = request.id;
+		j->op = request.op;
+		j->mf = request.mf;
+		j->mfEnd = request.mfEnd;
+	}
+	return pos;
+}
+
+static bool isOverHighWaterMark(const Connection *c) {
+	return c->outLen >= OUT_HIGH_WATER_MARK;
+}
+// True if there's at least one frame to answer (or a broken one to close the connection on) without reading more.
+static bool hasCompleteFrame(const Connection *c) {
+	ProtocolRequest request;
+	size_t frameSize;
+	return protocol_readRequest(c->in, c->inLen, &request, &frameSize) != PROTOCOL_FRAME_INCOMPLETE;
+}
+// Takes the frames of the connection into the batch, but not more than its share.
+static void addToBatch(Connection *c, Job **jobs, size_t *jobCnt, size_t *jobCap) {
+	size_t maxJobCnt = *jobCnt + MAX_JOBS_PER_CONNECTION;
+	c->consumed = extractJobs(c, jobs, jobCnt, jobCap, maxJobCnt < MAX_BATCH_JOBS ? maxJobCnt : MAX_BATCH_JOBS);
+}
+// Waits for EPOLLOUT while there are unsent responses, and stops waiting for EPOLLIN while there are too many.
+static void updateEvents(int epollFd, Connection *c) {
+	uint32_t events = (isOverHighWaterMark(c) ? 0 : EPOLLIN) | (c->outLen && !c->closing ? EPOLLOUT : 0);
+	if (events == c->events)
+		return;
+	struct epoll_event event = {.events = events, .data.ptr = c};
+	epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &event);
+	c->events = events;
+}
+
+static void flush(int epollFd, Connection *c, ServerStats *stats) {
+	size_t written = 0;
+	while (written < c->outLen) {
+		ssize_t n = send(c->fd, c->out + written, c->outLen - written, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				c->closing = true;
+			break;
+		}
+		written += n;
+	}
+	stats->bytesOut += written;
+	memmove(c->out, c->out + written, c->outLen - written);
+	c->outLen -= written;
+	updateEvents(epollFd, c);
+}
+
+// ------------------------------------------------------------------------------------------------ Main loop
+
+/**
+ * A socket file left by a server that crashed is replaced, but a socket that some server still listens on or any
+ * other kind of file is not.
+ */
+static bool removeStaleSocket(const char *socketPath, const struct sockaddr_un *addr) {
+	struct stat st;
+	if (lstat(socketPath, &st) != 0)
+		return errno == ENOENT;
+	if (!S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "Not a socket, refusing to replace it: %s\n", socketPath);
+		return false;
+	}
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	bool inUse = probe >= 0 && connect(probe, (const struct sockaddr *) addr, sizeof(*addr)) == 0;
+	if (probe >= 0)
+		close(probe);
+	if (inUse) {
+		fprintf(stderr, "The socket is already in use: %s\n", socketPath);
+		return false;
+	}
+	return unlink(socketPath) == 0;
+}
+
+static int listenOn(const char *socketPath) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "The socket path is too long: %s\n", socketPath);
+		return -1;
+	}
+	strcpy(addr.sun_path, socketPath);
+	if (!removeStaleSocket(socketPath, &addr))
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Couldn't create the socket");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		perror("Couldn't listen on the socket");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * SIGINT and SIGTERM are blocked in all the threads (workers inherit the mask), the I/O thread unblocks them only
+ * inside epoll_pwait(). Otherwise a signal could land on a worker, and the I/O thread would keep waiting for clients.
+ *
+ * @param prevMask receives the mask to restore on exit
+ * @param waitMask receives the mask to use in epoll_pwait()
+ */
+static void registerStopSignals(sigset_t *prevMask, sigset_t *waitMask) {
+	struct sigaction action = {.sa_handler = requestStop};// no SA_RESTART, so that epoll_pwait() is interrupted
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+
+	sigset_t stopSignals;
+	sigemptyset(&stopSignals);
+	sigaddset(&stopSignals, SIGINT);
+	sigaddset(&stopSignals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stopSignals, prevMask);
+	*waitMask = *prevMask;
+	sigdelset(waitMask, SIGINT);
+	sigdelset(waitMask, SIGTERM);
+}
+
+int serve(const char *socketPath, unsigned workerCnt) {
+	int exitCode = 1;
+	int listenFd = listenOn(socketPath);
+	if (listenFd < 0)
+		return exitCode;
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event listenEvent = {.events = EPOLLIN, .data.ptr = nullptr};
+	if (epollFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent) != 0) {
+		perror("Couldn't set up epoll");
+		goto closeListener;
+	}
+	ServerStats *stats = calloc(1, sizeof(ServerStats));
+	size_t jobCap = MIN_JOB_CAP, jobCnt;
+	Job *jobs = malloc(jobCap * sizeof(Job));
+	if (stats == nullptr || jobs == nullptr) {
+		perror("Couldn't allocate the server buffers");
+		goto freeBuffers;
+	}
+	sigset_t prevMask, waitMask;
+	registerStopSignals(&prevMask, &waitMask);
+	WorkerPool pool;
+	if (!WorkerPool_start(&pool, workerCnt)) {
+		perror("Couldn't start the workers");
+		goto stopPool;
+	}
+	stats->startedNs = nowNs();
+	fprintf(stderr, "Listening on %s with %u workers\n", socketPath, workerCnt);
+
+	struct epoll_event events[MAX_EVENTS];
+	Connection *backlog = nullptr;// have complete frames that didn't fit into the previous batch
+	bool accepting = true;
+	while (!stopRequested) {
+		// the backlog doesn't need to wait - its frames are already in the memory
+		int eventCnt = epoll_pwait(epollFd, events, MAX_EVENTS, backlog ? 0 : -1, &waitMask);
+		if (eventCnt < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_pwait() failed");
+			goto stopPool;
+		}
+		Connection *touched = nullptr;
+		jobCnt = 0;
+		for (Connection *c = backlog, *next; c; c = next) {
+			next = c->next;
+			addToBatch(c, &jobs, &jobCnt, &jobCap);
+			c->touched = true;
+			c->next = touched;
+			touched = c;
+		}
+		backlog = nullptr;
+		for (int i = 0; i < eventCnt; i++) {
+			Connection *c = events[i].data.ptr;
+			if (c == nullptr) {
+				accepting = acceptAll(epollFd, listenFd, stats);
+				continue;
+			}
+			if (events[i].events & EPOLLOUT)
+				flush(epollFd, c, stats);
+			if (c->touched) // from the backlog, it's read only after its remaining frames are answered
+				continue;
+			c->consumed = 0;
+			// a paused connection isn't read, but it may still have complete frames left from the previous rounds
+			if (!isOverHighWaterMark(c)) {
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					readAvailable(c, stats);
+				addToBatch(c, &jobs, &jobCnt, &jobCap);
+			}
+			c->touched = true;
+			c->next = touched;
+			touched = c;
+		}
+		if (jobCnt) {
+			for (size_t i = 0; i < jobCnt; i++)
+				if (jobs[i].op == PROTOCOL_OP_STATS) {
+					char body[PROTOCOL_MAX_RESPONSE_SIZE];
+					jobs[i].responseLen = protocol_writeResponse(jobs[i].id, PROTOCOL_OK, body,
+						formatStats(stats, body, sizeof(body)), jobs[i].response, sizeof(jobs[i].response));
+				}
+			runBatch(&pool, jobs, jobCnt);
+			stats->batches++;
+			for (size_t i = 0; i < jobCnt; i++) {
+				Connection *c = jobs[i].conn;
+				if (!ensureCapacity(&c->out, &c->outCap, c->outLen + jobs[i].responseLen)) {
+					c->closing = true;
+					continue;
+				}
+				memcpy(c->out + c->outLen, jobs[i].response, jobs[i].responseLen);
+				c->outLen += jobs[i].responseLen;
+				stats->errors += jobs[i].response[8] == PROTOCOL_ERROR;
+			}
+		}
+		for (Connection *c = touched; c; c = c->next) {
+			if (c->outLen)
+				flush(epollFd, c, stats);
+			else
+				updateEvents(epollFd, c);
+			memmove(c->in, c->in + c->consumed, c->inLen - c->consumed);
+			c->inLen -= c->consumed;
+			c->consumed = 0;
+		}
+		uint64_t now = nowNs();
+		for (size_t i = 0; i < jobCnt; i++) {
+			uint64_t latencyUs = (now - jobs[i].receivedNs) / 1000;
+			stats->latencyUs[latencyUs < LATENCY_BUCKET_CNT ? latencyUs : LATENCY_BUCKET_CNT - 1]++;
+		}
+		stats->requests += jobCnt;
+		for (Connection *c = touched, *next; c; c = next) {
+			next = c->next;
+			c->touched = false;
+			if (c->closing) {
+				Connection_close(c);
+				if (!accepting) // there's a free file descriptor now
+					setAccepting(epollFd, listenFd, accepting = true);
+			} else if (!isOverHighWaterMark(c) && hasCompleteFrame(c)) {
+				c->next = backlog;
+				backlog = c;
+			}
+		}
+		if (jobCap > MIN_JOB_CAP && jobCnt < jobCap / 4) { // give back the memory after a spike
+			Job *smallerJobs = realloc(jobs, jobCap / 2 * sizeof(Job));
+			if (smallerJobs != nullptr) {
+				jobs = smallerJobs;
+				jobCap /= 2;
+			}
+		}
+	}
+	char summary[PROTOCOL_MAX_RESPONSE_SIZE];
+	formatStats(stats, summary, sizeof(summary));
+	fprintf(stderr, "Stopped: %s\n", summary);
+	exitCode = 0;
+stopPool:
+	WorkerPool_stop(&pool);
+	pthread_sigmask(SIG_SETMASK, &prevMask, nullptr);
+freeBuffers:
+	free(jobs);
+	free(stats);
+closeListener:
+	close(listenFd);
+	unlink(socketPath);
+	if (epollFd >= 0)
+		close(epollFd);
+	return exitCode;
+}
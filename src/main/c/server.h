@@ -0,0 +1,20 @@
+#ifndef ELSCI_CHEMIKAZE_SERVER_H
+#define ELSCI_CHEMIKAZE_SERVER_H
+
+/**
+ * Listens on a Unix domain socket and answers requests described in `protocol.h` until SIGINT or SIGTERM.
+ *
+ * A single I/O thread waits for the sockets with epoll. All the requests that arrived from all the connections by
+ * the time epoll returns are parsed as one batch, big batches are split between the worker threads. Then the
+ * responses are written back, and the connections are kept open for the next requests. A client that pipelines many
+ * requests gets only a limited number of them into each batch, the rest go into the next ones. A client that doesn't
+ * read its responses stops being read from until it catches up. If the process runs out of file descriptors, new
+ * connections wait in the listen backlog until some of the current ones are closed.
+ *
+ * @param socketPath is removed on exit. If it already exists, it's replaced only if it's a socket that nobody
+ *                   listens on (left by a crashed server), otherwise the server refuses to start
+ * @param workerCnt threads that help the I/O thread to parse big batches, 0 means parse everything in the I/O thread
+ * @return exit code
+ */
+int serve(const char *socketPath, unsigned workerCnt);
+#endif //ELSCI_CHEMIKAZE_SERVER_H
@@ -6,6 +6,20 @@
 #include "test_util.h"
 #include "../../main/c/periodic_table.h"
 #include "../../main/c/mf_parser.h"
+#include "../../main/c/mf_stream.h"
+#include "../../main/c/csv.h"
+#include "../../main/c/protocol.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef CHEMIKAZE_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CHEMIKAZE_WITH_ZSTD
+#include <zstd.h>
+#endif
 
 char* parseMfOrFail(const char *mf) {
 	AtomCounts *atoms = parseMfOrPanic(mf);
@@ -69,6 +83,35 @@ void parseMf__numberAtTheBeginningMultiplesCounts() {
 	assertEqualsString("H4O2", parseMfOrFail("2H2O"));
 	assertEqualsString("", parseMfOrFail("0H2O"));
 }
+void parseMf__organicMfIsParsedSameAsGeneral() {
+	assertEqualsString("H5C6Br", parseMfOrFail("C6H5Br"));
+	assertEqualsString("HCONPFSBrCl", parseMfOrFail("ClBrSFPONCH"));
+	assertEqualsString("CCl4", parseMfOrFail("CCl4"));
+	assertEqualsString("H3C2ON", parseMfOrFail("C2H3NO"));
+	assertEqualsString("HC", parseMfOrFail("C0H1C1"));
+	assertEqualsString("CO", parseMfOrFail("CO"));
+	assertEqualsString("Co", parseMfOrFail("Co"));// starts like organic, but isn't
+	assertEqualsString("H3CB", parseMfOrFail("CH3B"));
+	assertEqualsString("ClNa", parseMfOrFail("NaCl"));
+	assertEqualsString("H4O2", parseMfOrFail("H2O.H2O"));
+	assertEqualsString("Couldn't parse CHZ. Unknown chemical symbol: Z", parseMfAndFail("CHZ"));
+	assertEqualsString("Couldn't parse CHi. Unknown chemical symbol: Hi", parseMfAndFail("CHi"));
+}
+char* parseMfChunkOrFail(const char *mf, size_t len) {
+	ChemikazeError *error = nullptr;
+	AtomCounts *atoms = parseMfChunk(mf, mf + len, &error);
+	if (error) {
+		logError(error->msg);
+		exit(1);
+	}
+	char *toMf = AtomCounts_toString(atoms);
+	AtomCounts_free(atoms);
+	return toMf;
+}
+void parseMfChunk__doesNotLookPastMfEnd() {
+	assertEqualsString("ClNa", parseMfChunkOrFail("NaCl)", 4));
+	assertEqualsString("HCNa", parseMfChunkOrFail("C(H)Na(", 6));
+}
 void parseMf__errsOnEmptyInput() {
 	assertEqualsString("Empty Molecular Formula", parseMfAndFail(""));
 	assertEqualsString("Empty Molecular Formula", parseMfAndFail(" "));
@@ -91,6 +134,265 @@ void parseMf_errsIfElementNotRecognized() {
 	assertEqualsString("Couldn't parse i2. Unexpected symbol: i", parseMfAndFail("i2"));
 }
 
+void collectLine(const char *start, const char *end, void *ctx) { // joins lines with '|'
+	char *joined = ctx;
+	strncat(joined, start, end - start);
+	strcat(joined, "|");
+}
+char* splitLines(const char *blocks[], unsigned blockCnt) {
+	static char joined[256];
+	joined[0] = '\0';
+	MfLineSplitter splitter;
+	MfLineSplitter_init(&splitter, collectLine, joined);
+	for (unsigned i = 0; i < blockCnt; i++)
+		MfLineSplitter_feed(&splitter, blocks[i], strlen(blocks[i]));
+	MfLineSplitter_finish(&splitter);
+	MfLineSplitter_free(&splitter);
+	return joined;
+}
+void MfLineSplitter__carriesPartialLinesAcrossBlocks() {
+	assertEqualsString("H2O|CH4|NaCl|", splitLines((const char*[]) {"H2O\nC", "H4\nNa", "Cl"}, 3));
+	assertEqualsString("H2O|CH4|", splitLines((const char*[]) {"H2O\n", "C", "", "H4\n"}, 4));
+	assertEqualsString("H2O||CH4|", splitLines((const char*[]) {"H2O\n\nCH4"}, 1));
+}
+
+#if defined(CHEMIKAZE_WITH_ZLIB) || defined(CHEMIKAZE_WITH_ZSTD)
+typedef struct { unsigned lineCnt; size_t carbonSum; } ParsedLinesStats;
+void parseLine(const char *start, const char *end, void *ctx) {
+	ParsedLinesStats *stats = ctx;
+	AtomCounts *atoms = parseMfChunk(start, end, &(ChemikazeError*) {nullptr});
+	stats->carbonSum += atoms->counts[1];
+	stats->lineCnt++;
+	AtomCounts_free(atoms);
+}
+int createTempFile(char *filepath) {
+	int fd = mkstemp(filepath);
+	if (fd < 0) {
+		logError("Couldn't create a temp file");
+		exit(1);
+	}
+	return fd;
+}
+void truncateToHalf(const char *filepath) {
+	struct stat st;
+	if (stat(filepath, &st) != 0 || truncate(filepath, st.st_size / 2) != 0) {
+		logError("Couldn't truncate the temp file");
+		exit(1);
+	}
+}
+void assertReadsAllMfs(const char *filepath, MfFileFormat format, unsigned mfCnt) {
+	ParsedLinesStats stats = {};
+	ChemikazeError *error = readMfLines(filepath, format, parseLine, &stats);
+	unlink(filepath);
+	assertEqualsString("", error ? error->msg : "");
+	assertEqualsUnsigned(mfCnt, stats.lineCnt);
+	assertEqualsDouble((double) mfCnt * (mfCnt + 1) / 2, (double) stats.carbonSum, 0);
+}
+void assertErrsOnTruncatedFile(const char *filepath, MfFileFormat format) {
+	truncateToHalf(filepath);
+	ParsedLinesStats stats = {};
+	ChemikazeError *error = readMfLines(filepath, format, parseLine, &stats);
+	unlink(filepath);
+	if (error == nullptr) {
+		logError("Expected an error for a truncated file!");
+		exit(1);
+	}
+	ChemikazeError_free(error);
+}
+#endif
+
+#ifdef CHEMIKAZE_WITH_ZLIB
+// Writes C1H4, C2H4, ... - enough of them to fill a few blocks.
+void writeGzMfs(char *filepath, unsigned mfCnt) {
+	close(createTempFile(filepath));
+	gzFile gz = gzopen(filepath, "wb");
+	for (unsigned i = 1; i <= mfCnt; i++)
+		gzprintf(gz, "C%uH4\n", i);
+	gzclose(gz);
+}
+void readMfLines__decompressesGzipAcrossBlocks() {
+	char filepath[] = "/tmp/chemikaze_test_XXXXXX";
+	unsigned mfCnt = 400000;// ~3.5MB, so at least 3 blocks and lines cut between the blocks
+	writeGzMfs(filepath, mfCnt);
+	assertReadsAllMfs(filepath, MF_FILE_GZIP, mfCnt);
+}
+void readMfLines__errsOnTruncatedGzip() {
+	char filepath[] = "/tmp/chemikaze_test_XXXXXX";
+	writeGzMfs(filepath, 400000);
+	assertErrsOnTruncatedFile(filepath, MF_FILE_GZIP);
+}
+#endif
+
+#ifdef CHEMIKAZE_WITH_ZSTD
+// Same MFs as writeGzMfs(), but split into 2 frames to check that concatenated frames are all read.
+void writeZstdMfs(char *filepath, unsigned mfCnt) {
+	FILE *f = fdopen(createTempFile(filepath), "wb");
+	for (unsigned frame = 0, from = 1; frame < 2; frame++) {
+		unsigned to = frame == 0 ? mfCnt / 2 : mfCnt;
+		size_t textCap = (size_t) (to - from + 1) * 16, textLen = 0;
+		char *text = malloc(textCap);
+		for (; from <= to; from++)
+			textLen += sprintf(text + textLen, "C%uH4\n", from);
+		size_t compressedCap = ZSTD_compressBound(textLen);
+		char *compressed = malloc(compressedCap);
+		size_t compressedLen = ZSTD_compress(compressed, compressedCap, text, textLen, 1);
+		fwrite(compressed, 1, compressedLen, f);
+		free(compressed);
+		free(text);
+	}
+	fclose(f);
+}
+void readMfLines__decompressesZstdAcrossBlocks() {
+	char filepath[] = "/tmp/chemikaze_test_XXXXXX";
+	unsigned mfCnt = 400000;
+	writeZstdMfs(filepath, mfCnt);
+	assertReadsAllMfs(filepath, MF_FILE_ZSTD, mfCnt);
+}
+void readMfLines__errsOnTruncatedZstd() {
+	char filepath[] = "/tmp/chemikaze_test_XXXXXX";
+	writeZstdMfs(filepath, 400000);
+	assertErrsOnTruncatedFile(filepath, MF_FILE_ZSTD);
+}
+#endif
+
+char* findCsvField(const char *row, char delimiter, char quote, unsigned column) {
+	static char field[256];
+	const char *start, *end;
+	if (!csv_findField(row, row + strlen(row), delimiter, quote, column, &start, &end))
+		return "<none>";
+	field[0] = '\0';
+	strncat(field, start, end - start);
+	return field;
+}
+void csv_findField__returnsFieldBounds() {
+	assertEqualsString("id", findCsvField("id,name,mf", ',', '"', 0));
+	assertEqualsString("mf", findCsvField("id,name,mf", ',', '"', 2));
+	assertEqualsString("", findCsvField("id,,mf", ',', '"', 1));
+	assertEqualsString("<none>", findCsvField("id,name,mf", ',', '"', 3));
+	assertEqualsString("C6H6", findCsvField("1\tbenzene, liquid\tC6H6", '\t', '\0', 2));
+}
+void csv_findField__skipsQuotedDelimiters() {
+	assertEqualsString("H2O", findCsvField("1,\"water, \"\"pure\"\"\",H2O", ',', '"', 2));
+	assertEqualsString("water, \"\"pure\"\"", findCsvField("1,\"water, \"\"pure\"\"\",H2O", ',', '"', 1));
+	assertEqualsString("H2O", findCsvField("\"H2O\"", ',', '"', 0));
+	assertEqualsString("<none>", findCsvField("\"H2O,", ',', '"', 0));// the quote isn't closed
+	assertEqualsString("id", findCsvField("id,\"H2O,", ',', '"', 0));
+}
+void csv_isRowComplete__isFalseIfQuoteContinuesOnNextLine() {
+	const char *row = "1,\"water,\nmultiline\",H2O";
+	assertEqualsUnsigned(true, csv_isRowComplete(row, row + strlen(row), ',', '"'));
+	assertEqualsUnsigned(false, csv_isRowComplete(row, row + 10, ',', '"'));// "1,"water,
+	row = "1,\"a \"\"quoted\"\" name\"\"";
+	assertEqualsUnsigned(false, csv_isRowComplete(row, row + strlen(row), ',', '"'));
+	row = "1,\"name";
+	assertEqualsUnsigned(true, csv_isRowComplete(row, row + strlen(row), '\t', '\0'));
+}
+bool isQuoteOpenAtEnd(const char *line, bool openAtStart) {
+	return csv_isQuoteOpenAtEnd(line, line + strlen(line), ',', '"', openAtStart);
+}
+void csv_isQuoteOpenAtEnd__continuesStateOfPreviousLines() {
+	assertEqualsUnsigned(true, isQuoteOpenAtEnd("1,\"water,", false));
+	assertEqualsUnsigned(true, isQuoteOpenAtEnd("still water", true));
+	assertEqualsUnsigned(false, isQuoteOpenAtEnd("still water", false));
+	assertEqualsUnsigned(false, isQuoteOpenAtEnd("multiline\",H2O", true));
+	assertEqualsUnsigned(true, isQuoteOpenAtEnd("a \"\"quoted\"\" name", true));
+	assertEqualsUnsigned(true, isQuoteOpenAtEnd("end\",\"another", true));
+	assertEqualsUnsigned(false, isQuoteOpenAtEnd("\"", true));
+	assertEqualsUnsigned(true, csv_isQuoteOpenAtEnd("x", "x" + 1, '\t', '\0', true));
+}
+void csv_countFields__countsQuotedFieldsOnce() {
+	const char *row = "1,\"water, pure\",H2O";
+	assertEqualsUnsigned(3, csv_countFields(row, row + strlen(row), ',', '"'));
+	row = "1,,";
+	assertEqualsUnsigned(3, csv_countFields(row, row + strlen(row), ',', '"'));
+	assertEqualsUnsigned(1, csv_countFields(row, row, ',', '"'));
+}
+
+void protocol_writeParseResponse__writesCountsOfEachElement() {
+	char frame[PROTOCOL_MAX_RESPONSE_SIZE];
+	const char *mf = "H2O";
+	size_t len = protocol_writeParseResponse(42, mf, mf + 3, frame);
+	assertEqualsUnsigned(PROTOCOL_HEADER_SIZE + 2 * 5, len);
+	assertEqualsUnsigned(len - PROTOCOL_LEN_SIZE, protocol_get32(frame));
+	assertEqualsUnsigned(42, protocol_get32(frame + 4));
+	assertEqualsUnsigned(PROTOCOL_OK, frame[8]);
+	assertEqualsUnsigned(0/*H*/, frame[9]);
+	assertEqualsUnsigned(2, protocol_get32(frame + 10));
+	assertEqualsUnsigned(2/*O*/, frame[14]);
+	assertEqualsUnsigned(1, protocol_get32(frame + 15));
+}
+void protocol_writeParseResponse__writesErrors() {
+	char frame[PROTOCOL_MAX_RESPONSE_SIZE];
+	const char *mf = "A2";
+	size_t len = protocol_writeParseResponse(0xFFFFFFFF, mf, mf + 2, frame);
+	assertEqualsUnsigned(0xFFFFFFFF, protocol_get32(frame + 4));
+	assertEqualsUnsigned(PROTOCOL_ERROR, frame[8]);
+	assertEqualsUnsigned(PARSE, frame[9]);
+	frame[len] = '\0';
+	assertEqualsString("Couldn't parse A2. Unknown chemical symbol: A", frame + 10);
+}
+void protocol_writeError__usesProtocolErrorCode() {
+	char frame[PROTOCOL_MAX_RESPONSE_SIZE];
+	size_t len = protocol_writeError(7, PROTOCOL_UNKNOWN_OP, "Unknown op", frame);
+	assertEqualsUnsigned(PROTOCOL_ERROR, frame[8]);
+	assertEqualsUnsigned(PROTOCOL_UNKNOWN_OP, (unsigned char) frame[9]);
+	frame[len] = '\0';
+	assertEqualsString("Unknown op", frame + 10);
+}
+
+size_t writeRequest(char *dst, uint32_t id, const char *mf) {
+	size_t mfLen = strlen(mf);
+	protocol_put32(dst, PROTOCOL_HEADER_SIZE - PROTOCOL_LEN_SIZE + mfLen);
+	protocol_put32(dst + 4, id);
+	dst[8] = PROTOCOL_OP_PARSE;
+	memcpy(dst + PROTOCOL_HEADER_SIZE, mf, mfLen);
+	return PROTOCOL_HEADER_SIZE + mfLen;
+}
+char* requestMf(const ProtocolRequest *r) {
+	static char mf[64];
+	mf[0] = '\0';
+	strncat(mf, r->mf, r->mfEnd - r->mf);
+	return mf;
+}
+void protocol_readRequest__readsManyFramesInOrder() {
+	char buf[256];
+	const char *mfs[] = {"H2O", "", "NaCl"};
+	size_t len = 0;
+	for (unsigned i = 0; i < 3; i++)
+		len += writeRequest(buf + len, i + 1, mfs[i]);
+
+	ProtocolRequest r;
+	size_t pos = 0, frameSize;
+	for (unsigned i = 0; i < 3; i++, pos += frameSize) {
+		assertEqualsUnsigned(PROTOCOL_FRAME_OK, protocol_readRequest(buf + pos, len - pos, &r, &frameSize));
+		assertEqualsUnsigned(i + 1, r.id);
+		assertEqualsUnsigned(PROTOCOL_OP_PARSE, r.op);
+		assertEqualsString(mfs[i], requestMf(&r));
+	}
+	assertEqualsUnsigned(len, pos);
+	assertEqualsUnsigned(PROTOCOL_FRAME_INCOMPLETE, protocol_readRequest(buf + pos, 0, &r, &frameSize));
+}
+void protocol_readRequest__waitsForPartialFrame() {
+	char buf[64];
+	size_t len = writeRequest(buf, 5, "C6H5Br");
+	ProtocolRequest r;
+	size_t frameSize;
+	for (size_t partial = 0; partial < len; partial++)
+		assertEqualsUnsigned(PROTOCOL_FRAME_INCOMPLETE, protocol_readRequest(buf, partial, &r, &frameSize));
+	assertEqualsUnsigned(PROTOCOL_FRAME_OK, protocol_readRequest(buf, len, &r, &frameSize));
+	assertEqualsUnsigned(len, frameSize);
+	assertEqualsString("C6H5Br", requestMf(&r));
+}
+void protocol_readRequest__detectsBrokenLength() {
+	char buf[PROTOCOL_HEADER_SIZE] = {};
+	ProtocolRequest r;
+	size_t frameSize;
+	protocol_put32(buf, PROTOCOL_HEADER_SIZE - PROTOCOL_LEN_SIZE - 1);// too short to hold id and op
+	assertEqualsUnsigned(PROTOCOL_FRAME_BROKEN, protocol_readRequest(buf, sizeof(buf), &r, &frameSize));
+	protocol_put32(buf, PROTOCOL_MAX_FRAME_LEN + 1);
+	assertEqualsUnsigned(PROTOCOL_FRAME_BROKEN, protocol_readRequest(buf, PROTOCOL_LEN_SIZE, &r, &frameSize));
+}
+
 int main(void) {
 	register_signals();
 	logInfo("Testing periodic_table");
@@ -104,7 +406,35 @@ int main(void) {
 	RUN_TEST(parseMf__numberAtTheBeginningMultiplesCounts);
 	RUN_TEST(parseMf__dotsSeparateComponents_butComponentsAreSummedUp);
 	RUN_TEST(parseMf__complicatedMfIsParsedIntoCounts);
+	RUN_TEST(parseMf__organicMfIsParsedSameAsGeneral);
 	RUN_TEST(parseMf__errsIfParenthesesDoNotMatch);
+	RUN_TEST(parseMfChunk__doesNotLookPastMfEnd);
 	RUN_TEST(parseMf__errsOnEmptyInput);
 	RUN_TEST(parseMf_errsIfElementNotRecognized);
+
+	logInfo("Testing mf_stream");
+	RUN_TEST(MfLineSplitter__carriesPartialLinesAcrossBlocks);
+#ifdef CHEMIKAZE_WITH_ZLIB
+	RUN_TEST(readMfLines__decompressesGzipAcrossBlocks);
+	RUN_TEST(readMfLines__errsOnTruncatedGzip);
+#endif
+#ifdef CHEMIKAZE_WITH_ZSTD
+	RUN_TEST(readMfLines__decompressesZstdAcrossBlocks);
+	RUN_TEST(readMfLines__errsOnTruncatedZstd);
+#endif
+
+	logInfo("Testing csv");
+	RUN_TEST(csv_findField__returnsFieldBounds);
+	RUN_TEST(csv_findField__skipsQuotedDelimiters);
+	RUN_TEST(csv_isRowComplete__isFalseIfQuoteContinuesOnNextLine);
+	RUN_TEST(csv_isQuoteOpenAtEnd__continuesStateOfPreviousLines);
+	RUN_TEST(csv_countFields__countsQuotedFieldsOnce);
+
+	logInfo("Testing protocol");
+	RUN_TEST(protocol_writeParseResponse__writesCountsOfEachElement);
+	RUN_TEST(protocol_writeParseResponse__writesErrors);
+	RUN_TEST(protocol_writeError__usesProtocolErrorCode);
+	RUN_TEST(protocol_readRequest__readsManyFramesInOrder);
+	RUN_TEST(protocol_readRequest__waitsForPartialFrame);
+	RUN_TEST(protocol_readRequest__detectsBrokenLength);
 }